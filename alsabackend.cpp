@@ -0,0 +1,365 @@
+/****************************************************************************
+**
+** This file is part of pulseaudio plugin for low-level audio backend in Qt4
+**
+**  pulseaudio Qt4 plugin is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU Lesser General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  pulseaudio Qt4 plugin is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public License
+**  along with pulseaudio Qt4 plugin.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#include <QDebug>
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "alsabackend.h"
+
+static bool pcmFormat(const QAudioFormat& format, snd_pcm_format_t* out)
+{
+    bool le = (format.byteOrder() == QAudioFormat::LittleEndian);
+
+    if(format.sampleSize() == 8) {
+        if(format.sampleType() == QAudioFormat::SignedInt)
+            *out = SND_PCM_FORMAT_S8;
+        else
+            *out = SND_PCM_FORMAT_U8;
+        return true;
+    }
+    if(format.sampleSize() == 16) {
+        if(format.sampleType() == QAudioFormat::SignedInt)
+            *out = le ? SND_PCM_FORMAT_S16_LE : SND_PCM_FORMAT_S16_BE;
+        else if(format.sampleType() == QAudioFormat::UnSignedInt)
+            *out = le ? SND_PCM_FORMAT_U16_LE : SND_PCM_FORMAT_U16_BE;
+        else
+            return false;
+        return true;
+    }
+    if(format.sampleSize() == 32) {
+        if(format.sampleType() == QAudioFormat::SignedInt)
+            *out = le ? SND_PCM_FORMAT_S32_LE : SND_PCM_FORMAT_S32_BE;
+        else if(format.sampleType() == QAudioFormat::UnSignedInt)
+            *out = le ? SND_PCM_FORMAT_U32_LE : SND_PCM_FORMAT_U32_BE;
+        else if(format.sampleType() == QAudioFormat::Float)
+            *out = le ? SND_PCM_FORMAT_FLOAT_LE : SND_PCM_FORMAT_FLOAT_BE;
+        else
+            return false;
+        return true;
+    }
+    return false;
+}
+
+ALSAOutputBackend::ALSAOutputBackend(const QByteArray& pcm, QObject* parent)
+    : PULSEOutputBackend(parent)
+{
+    this->pcm = pcm;
+    handle = 0;
+    bufferFrames = 0;
+    periodFrames = 0;
+    bytesPerFrame = 0;
+    frequency = 0;
+    fds = 0;
+    nfds = 0;
+
+    drainTimer = new QTimer(this);
+    drainTimer->setSingleShot(true);
+    connect(drainTimer,SIGNAL(timeout()),SLOT(drainCheck()));
+}
+
+ALSAOutputBackend::~ALSAOutputBackend()
+{
+    close();
+}
+
+bool ALSAOutputBackend::open(const QAudioFormat& format, unsigned int bufferTime,
+        unsigned int periodTime)
+{
+    snd_pcm_format_t pcmformat;
+    snd_pcm_hw_params_t* hwparams;
+    snd_pcm_sw_params_t* swparams;
+    unsigned int rate = format.frequency();
+    int dir = 0;
+    int rc;
+
+    if(!pcmFormat(format, &pcmformat)) {
+        qWarning()<<"unsupported format";
+        return false;
+    }
+
+    rc = snd_pcm_open(&handle, pcm.constData(), SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+    if(rc < 0) {
+        qWarning()<<"QAudioOutput failed to open ALSA device"<<pcm<<":"<<snd_strerror(rc);
+        handle = 0;
+        return false;
+    }
+
+    snd_pcm_hw_params_alloca(&hwparams);
+    snd_pcm_sw_params_alloca(&swparams);
+
+    if((rc = snd_pcm_hw_params_any(handle, hwparams)) < 0
+            || (rc = snd_pcm_hw_params_set_access(handle, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0
+            || (rc = snd_pcm_hw_params_set_format(handle, hwparams, pcmformat)) < 0
+            || (rc = snd_pcm_hw_params_set_channels(handle, hwparams, format.channels())) < 0
+            || (rc = snd_pcm_hw_params_set_rate_near(handle, hwparams, &rate, &dir)) < 0
+            || (rc = snd_pcm_hw_params_set_buffer_time_near(handle, hwparams, &bufferTime, &dir)) < 0
+            || (rc = snd_pcm_hw_params_set_period_time_near(handle, hwparams, &periodTime, &dir)) < 0
+            || (rc = snd_pcm_hw_params(handle, hwparams)) < 0) {
+        qWarning()<<"QAudioOutput can't configure ALSA device"<<pcm<<":"<<snd_strerror(rc);
+        close();
+        return false;
+    }
+    if(rate != (unsigned int)format.frequency()) {
+        qWarning()<<"QAudioOutput: ALSA device"<<pcm<<"can't play at"<<format.frequency()<<"Hz";
+        close();
+        return false;
+    }
+    snd_pcm_hw_params_get_buffer_size(hwparams, &bufferFrames);
+    snd_pcm_hw_params_get_period_size(hwparams, &periodFrames, &dir);
+
+    // Wake up once per period, start explicitly from write()
+    if((rc = snd_pcm_sw_params_current(handle, swparams)) < 0
+            || (rc = snd_pcm_sw_params_set_avail_min(handle, swparams, periodFrames)) < 0
+            || (rc = snd_pcm_sw_params_set_start_threshold(handle, swparams, bufferFrames)) < 0
+            || (rc = snd_pcm_sw_params(handle, swparams)) < 0) {
+        qWarning()<<"QAudioOutput can't configure ALSA device"<<pcm<<":"<<snd_strerror(rc);
+        close();
+        return false;
+    }
+
+    bytesPerFrame = snd_pcm_frames_to_bytes(handle, 1);
+    frequency = rate;
+
+    nfds = snd_pcm_poll_descriptors_count(handle);
+    fds = new struct pollfd[nfds];
+    snd_pcm_poll_descriptors(handle, fds, nfds);
+    for(int i = 0; i < nfds; i++) {
+        QSocketNotifier* n = new QSocketNotifier(fds[i].fd,
+                (fds[i].events & POLLIN) ? QSocketNotifier::Read : QSocketNotifier::Write, this);
+        connect(n,SIGNAL(activated(int)),SLOT(pollActivated()));
+        notifiers.append(n);
+    }
+
+    return true;
+}
+
+void ALSAOutputBackend::close()
+{
+    drainTimer->stop();
+
+    qDeleteAll(notifiers);
+    notifiers.clear();
+    delete[] fds;
+    fds = 0;
+    nfds = 0;
+
+    if(handle) {
+        snd_pcm_nonblock(handle, 0);
+        snd_pcm_drain(handle);
+        snd_pcm_close(handle);
+        handle = 0;
+    }
+}
+
+qint64 ALSAOutputBackend::write(const char* data, qint64 len)
+{
+    snd_pcm_uframes_t frames;
+    snd_pcm_uframes_t done = 0;
+    int retry = 0;
+
+    if(!handle)
+        return -1;
+
+    frames = len / bytesPerFrame;
+    while(done < frames) {
+        const snd_pcm_channel_area_t* areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t chunk;
+        snd_pcm_sframes_t avail;
+        snd_pcm_sframes_t committed;
+        int rc;
+
+        avail = snd_pcm_avail_update(handle);
+        if(avail < 0) {
+            if(retry++ > 2 || !recover((int)avail))
+                return -1;
+            continue;
+        }
+        if(avail == 0)
+            break;
+
+        chunk = qMin((snd_pcm_uframes_t)avail, frames - done);
+        rc = snd_pcm_mmap_begin(handle, &areas, &offset, &chunk);
+        if(rc < 0) {
+            if(retry++ > 2 || !recover(rc))
+                return -1;
+            continue;
+        }
+
+        // interleaved access: one area describes the whole frame
+        memcpy((char*)areas[0].addr + areas[0].first/8 + offset*(areas[0].step/8),
+                data + done*bytesPerFrame, chunk*bytesPerFrame);
+
+        committed = snd_pcm_mmap_commit(handle, offset, chunk);
+        if(committed < 0 || (snd_pcm_uframes_t)committed != chunk) {
+            if(retry++ > 2 || !recover(committed < 0 ? (int)committed : -EPIPE))
+                return -1;
+            continue;
+        }
+        done += committed;
+    }
+
+    if(snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(handle);
+        if(avail >= 0 && bufferFrames - avail >= periodFrames)
+            snd_pcm_start(handle);
+    }
+
+    if(done > 0) {
+        drainTimer->stop();
+        setArmed(true);
+    }
+    return done*bytesPerFrame;
+}
+
+int ALSAOutputBackend::bufferSize() const
+{
+    return bufferFrames*bytesPerFrame;
+}
+
+int ALSAOutputBackend::periodSize() const
+{
+    return periodFrames*bytesPerFrame;
+}
+
+int ALSAOutputBackend::bytesWritable()
+{
+    snd_pcm_sframes_t avail;
+
+    if(!handle)
+        return 0;
+
+    avail = snd_pcm_avail_update(handle);
+    if(avail < 0) {
+        if(!recover((int)avail))
+            return 0;
+        avail = snd_pcm_avail_update(handle);
+        if(avail < 0)
+            return 0;
+    }
+    return avail*bytesPerFrame;
+}
+
+bool ALSAOutputBackend::isPeriodDriven() const
+{
+    return true;
+}
+
+qint64 ALSAOutputBackend::latencyUSecs()
+{
+    snd_pcm_sframes_t delay;
+
+    if(!handle || snd_pcm_delay(handle, &delay) < 0)
+        return -1;
+    return qint64(1000000)*qMax(delay, (snd_pcm_sframes_t)0)/frequency;
+}
+
+void ALSAOutputBackend::setCorked(bool corked)
+{
+    if(!handle)
+        return;
+
+    drainTimer->stop();
+    if(corked) {
+        snd_pcm_drop(handle);
+        setArmed(false);
+    } else {
+        snd_pcm_prepare(handle);
+        setArmed(true);
+    }
+}
+
+void ALSAOutputBackend::pollActivated()
+{
+    unsigned short revents = 0;
+    snd_pcm_sframes_t avail;
+
+    if(!handle)
+        return;
+
+    // the notifier only says an fd is ready, fetch revents for ALSA to decode
+    if(poll(fds, nfds, 0) <= 0)
+        return;
+    snd_pcm_poll_descriptors_revents(handle, fds, nfds, &revents);
+    if(revents & POLLERR) {
+        setArmed(false);
+        if(snd_pcm_state(handle) == SND_PCM_STATE_XRUN) {
+            recover(-EPIPE);
+            emit underrun();
+        } else {
+            // let the next write() report the failure
+            emit periodElapsed();
+        }
+        return;
+    }
+    if(!(revents & POLLOUT))
+        return;
+
+    // An empty ring buffer stays writable forever, so stop listening until
+    // the output writes again and watch for the queued audio to run out.
+    setArmed(false);
+    avail = snd_pcm_avail_update(handle);
+    if(avail >= 0 && (snd_pcm_uframes_t)avail < bufferFrames)
+        drainTimer->start((bufferFrames - avail)*1000/frequency + 1);
+
+    emit periodElapsed();
+}
+
+void ALSAOutputBackend::drainCheck()
+{
+    snd_pcm_sframes_t avail;
+
+    if(!handle)
+        return;
+
+    avail = snd_pcm_avail_update(handle);
+    if(avail < 0) {
+        recover((int)avail);
+        emit underrun();
+    } else if((snd_pcm_uframes_t)avail >= bufferFrames) {
+        if(snd_pcm_state(handle) != SND_PCM_STATE_PREPARED)
+            recover(-EPIPE);
+        emit underrun();
+    } else {
+        // less than a period queued never reached snd_pcm_start()
+        if(snd_pcm_state(handle) == SND_PCM_STATE_PREPARED)
+            snd_pcm_start(handle);
+        drainTimer->start((bufferFrames - avail)*1000/frequency + 1);
+    }
+    emit periodElapsed();
+}
+
+bool ALSAOutputBackend::recover(int err)
+{
+    int rc = snd_pcm_recover(handle, err, 1);
+    if(rc < 0) {
+        qWarning()<<"QAudioOutput: ALSA device"<<pcm<<"failed:"<<snd_strerror(rc);
+        return false;
+    }
+    return true;
+}
+
+void ALSAOutputBackend::setArmed(bool armed)
+{
+    for(int i = 0; i < notifiers.size(); i++)
+        notifiers.at(i)->setEnabled(armed);
+}
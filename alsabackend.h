@@ -0,0 +1,73 @@
+/****************************************************************************
+**
+** This file is part of pulseaudio plugin for low-level audio backend in Qt4
+**
+**  pulseaudio Qt4 plugin is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU Lesser General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  pulseaudio Qt4 plugin is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public License
+**  along with pulseaudio Qt4 plugin.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#ifndef QALSABACKEND_H
+#define QALSABACKEND_H
+
+#include <QList>
+#include <QTimer>
+#include <QSocketNotifier>
+
+#include <alsa/asoundlib.h>
+
+#include "pulseaudio.h"
+
+// Direct ALSA output used when no daemon is reachable or when asked for
+// with an "alsa[:<pcm>]" device name. Writes go straight into the ring
+// buffer through snd_pcm_mmap_begin()/snd_pcm_mmap_commit() and the output
+// is woken once per period from the PCM poll descriptors.
+class ALSAOutputBackend : public PULSEOutputBackend
+{
+    Q_OBJECT
+public:
+    ALSAOutputBackend(const QByteArray& pcm, QObject* parent = 0);
+    ~ALSAOutputBackend();
+
+    bool open(const QAudioFormat& format, unsigned int bufferTime,
+            unsigned int periodTime);
+    void close();
+    qint64 write(const char* data, qint64 len);
+    int bufferSize() const;
+    int periodSize() const;
+    int bytesWritable();
+    bool isPeriodDriven() const;
+    qint64 latencyUSecs();
+    void setCorked(bool corked);
+
+private slots:
+    void pollActivated();
+    void drainCheck();
+
+private:
+    bool recover(int err);
+    void setArmed(bool armed);
+
+    QByteArray pcm;
+    snd_pcm_t* handle;
+    snd_pcm_uframes_t bufferFrames;
+    snd_pcm_uframes_t periodFrames;
+    int bytesPerFrame;
+    int frequency;
+    struct pollfd* fds;
+    int nfds;
+    QList<QSocketNotifier*> notifiers;
+    QTimer* drainTimer;
+};
+
+#endif
@@ -0,0 +1,106 @@
+/****************************************************************************
+**
+** This file is part of pulseaudio plugin for low-level audio backend in Qt4
+**
+**  pulseaudio Qt4 plugin is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU Lesser General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  pulseaudio Qt4 plugin is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public License
+**  along with pulseaudio Qt4 plugin.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+// Push mode throughput by packet size: one QIODevice::write() per packet
+// against one writeBatch() for as many packets as the output has room for.
+//
+//   qmake && make && ./bench_batchwrite [device] [megabytes]
+//
+// The default device, alsa:null, takes data as fast as it comes, so the
+// numbers are the per-call cost of the plugin rather than the sound card.
+
+#include <QCoreApplication>
+#include <QTime>
+#include <QVector>
+
+#include <QtMultimedia>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "pulseaudio.h"
+
+static double run(PULSEAudioOutput* output, int packet, qint64 total, bool batch)
+{
+    QByteArray data(packet, 0);
+    QVector<struct iovec> iov;
+    QVector<qint64> accepted;
+    QTime wall;
+    qint64 sent = 0;
+
+    QIODevice* device = output->start(0);
+    if(!device)
+        return -1;
+    PULSEOutputPrivate* batcher = static_cast<PULSEOutputPrivate*>(device);
+
+    wall.start();
+    while(sent < total) {
+        int packets = output->bytesFree()/packet;
+
+        if(batch && packets > 0) {
+            iov.resize(packets);
+            accepted.resize(packets);
+            for(int i = 0; i < packets; i++) {
+                iov[i].iov_base = data.data();
+                iov[i].iov_len = packet;
+            }
+            sent += batcher->writeBatch(iov.data(), packets, accepted.data());
+        } else {
+            for(int i = 0; i < packets; i++)
+                sent += device->write(data.constData(), packet);
+        }
+        // lets the device report room for the next round
+        QCoreApplication::processEvents();
+    }
+    int msecs = qMax(wall.elapsed(), 1);
+    output->stop();
+
+    return sent/1048576.0/(msecs/1000.0);
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    QAudioFormat format;
+    QByteArray device = argc > 1 ? argv[1] : "alsa:null";
+    qint64 total = qint64(argc > 2 ? atoi(argv[2]) : 64)*1048576;
+    static const int sizes[] = { 16, 64, 256, 1024, 4096 };
+
+    format.setFrequency(44100);
+    format.setChannels(2);
+    format.setSampleSize(16);
+    format.setSampleType(QAudioFormat::SignedInt);
+    format.setByteOrder(QAudioFormat::LittleEndian);
+    format.setCodec("audio/pcm");
+
+    PULSEAudioOutput output(device, format);
+
+    printf("%8s %14s %14s\n", "packet", "write MB/s", "batch MB/s");
+    for(unsigned int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        double single = run(&output, sizes[i], total, false);
+        double batch = run(&output, sizes[i], total, true);
+        if(single < 0 || batch < 0) {
+            fprintf(stderr, "can't open %s\n", device.constData());
+            return 1;
+        }
+        printf("%8d %14.1f %14.1f\n", sizes[i], single, batch);
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+/****************************************************************************
+**
+** This file is part of pulseaudio plugin for low-level audio backend in Qt4
+**
+**  pulseaudio Qt4 plugin is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU Lesser General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  pulseaudio Qt4 plugin is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public License
+**  along with pulseaudio Qt4 plugin.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+// Cost of triggering a short sound: a play from the daemon's sample cache
+// against opening a stream and writing the PCM into it, which is what an
+// application without the cache does per sound.
+//
+//   qmake && make && ./bench_samplecache [count]
+//
+// Needs a running daemon (PULSE_SERVER is honoured); a null sink keeps it
+// quiet.  Wall time is per trigger until the client is done with it, CPU
+// time is this process only.
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QTime>
+
+#include <QtMultimedia>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pulseaudio.h"
+#include "samplecache.h"
+
+// 100ms 1kHz click, 16 bit stereo
+static QByteArray click(const QAudioFormat& format)
+{
+    int frames = format.frequency()/10;
+    QByteArray pcm(frames*4, 0);
+    qint16* out = (qint16*)pcm.data();
+
+    for(int i = 0; i < frames; i++) {
+        qint16 v = (qint16)(8000*sin(2*M_PI*1000*i/format.frequency())*(frames-i)/frames);
+        out[2*i] = v;
+        out[2*i+1] = v;
+    }
+    return pcm;
+}
+
+static void report(const char* what, int count, int msecs, clock_t cpu)
+{
+    printf("%-10s %6d triggers  %9.1f us wall  %9.1f us cpu per trigger\n", what, count,
+            1000.0*msecs/count, 1000000.0*cpu/CLOCKS_PER_SEC/count);
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    QAudioFormat format;
+    pa_sample_spec spec;
+    QTime wall;
+    clock_t cpu;
+    int count = argc > 1 ? atoi(argv[1]) : 200;
+    int err;
+
+    format.setFrequency(44100);
+    format.setChannels(2);
+    format.setSampleSize(16);
+    format.setSampleType(QAudioFormat::SignedInt);
+    format.setByteOrder(QAudioFormat::LittleEndian);
+    format.setCodec("audio/pcm");
+    pulseSampleSpec(format, &spec);
+
+    QByteArray pcm = click(format);
+
+    // streaming: one stream per sound, as QAudioOutput::start() would
+    wall.start();
+    cpu = clock();
+    for(int i = 0; i < count; i++) {
+        pa_simple* s = pa_simple_new(NULL, "bench_samplecache", PA_STREAM_PLAYBACK, NULL,
+                "click", &spec, NULL, NULL, &err);
+        if(!s) {
+            qWarning()<<"can't open a stream:"<<pa_strerror(err);
+            return 1;
+        }
+        pa_simple_write(s, pcm.constData(), pcm.size(), &err);
+        pa_simple_free(s);
+    }
+    report("stream", count, wall.elapsed(), clock() - cpu);
+
+    // sample cache: uploaded once, then triggered by name
+    PULSESampleCache cache;
+    if(!cache.upload("click", pcm, format)) {
+        qWarning()<<"can't upload the sample";
+        return 1;
+    }
+    wall.start();
+    cpu = clock();
+    for(int i = 0; i < count; i++)
+        cache.play("click");
+    report("cache", count, wall.elapsed(), clock() - cpu);
+
+    return 0;
+}
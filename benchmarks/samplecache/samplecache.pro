@@ -0,0 +1,19 @@
+TARGET   = bench_samplecache
+
+TEMPLATE = app
+CONFIG  += qt console
+CONFIG  -= app_bundle
+
+QT      += multimedia
+
+LIBS+=-L/usr/lib/i386-linux-gnu -lpulse-simple -lpulse -lasound
+
+INCLUDEPATH += ../..
+
+HEADERS += ../../pulseaudio.h \
+           ../../alsabackend.h \
+           ../../samplecache.h
+SOURCES += main.cpp \
+           ../../pulseaudio.cpp \
+           ../../alsabackend.cpp \
+           ../../samplecache.cpp
@@ -20,7 +20,9 @@
 #include <QtMultimedia>
 
 #include "pulseaudio.h"
+#include "samplecache.h"
 
+#include <qpointer.h>
 #include <qstringlist.h>
 #include <qiodevice.h>
 #include <qbytearray.h>
@@ -30,6 +32,7 @@ QT_BEGIN_NAMESPACE
 
 class PULSEAudioPlugin : public QAudioEnginePlugin
 {
+    Q_OBJECT
 public:
     PULSEAudioPlugin();
 
@@ -39,10 +42,25 @@ public:
     QAbstractAudioInput* createInput(const QByteArray& device, const QAudioFormat& format);
     QAbstractAudioOutput* createOutput(const QByteArray& device, const QAudioFormat& format);
     QAbstractAudioDeviceInfo* createDeviceInfo(const QByteArray& device, QAudio::Mode mode);
+
+public slots:
+    // Reachable through QMetaObject::invokeMethod() on the plugin instance
+    bool uploadSample(const QString& name, const QByteArray& pcm, const QAudioFormat& format);
+    bool playSample(const QString& name, qreal volume = 1.0);
+    bool removeSample(const QString& name);
+
+    // The output playing, queuing or (in push mode) returned by start()
+    // as device, for the Q_INVOKABLE queue API of PULSEAudioOutput
+    QObject* output(QIODevice* device);
+
+private:
+    PULSESampleCache* sampleCache;
+    QList<QPointer<PULSEAudioOutput> > outputs;
 };
 
 PULSEAudioPlugin::PULSEAudioPlugin()
 {
+    sampleCache = new PULSESampleCache(this);
 }
 
 QStringList PULSEAudioPlugin::keys() const
@@ -55,8 +73,10 @@ QStringList PULSEAudioPlugin::keys() const
 QList<QByteArray> PULSEAudioPlugin::availableDevices(QAudio::Mode mode) const
 {
     QList<QByteArray> devices;
-    if (mode == QAudio::AudioOutput)
+    if (mode == QAudio::AudioOutput) {
         devices.append("pulse");
+        devices.append("alsa");
+    }
 
     return devices;
 }
@@ -71,7 +91,11 @@ QAbstractAudioInput* PULSEAudioPlugin::createInput(const QByteArray& device, con
 
 QAbstractAudioOutput* PULSEAudioPlugin::createOutput(const QByteArray& device, const QAudioFormat& format)
 {
-    return (new PULSEAudioOutput(device,format));
+    PULSEAudioOutput* out = new PULSEAudioOutput(device,format);
+
+    outputs.removeAll(QPointer<PULSEAudioOutput>());
+    outputs.append(out);
+    return out;
 }
 
 QAbstractAudioDeviceInfo* PULSEAudioPlugin::createDeviceInfo(const QByteArray& device, QAudio::Mode mode)
@@ -79,8 +103,34 @@ QAbstractAudioDeviceInfo* PULSEAudioPlugin::createDeviceInfo(const QByteArray& d
     return (new PULSEAudioDeviceInfo(device,mode));
 }
 
+bool PULSEAudioPlugin::uploadSample(const QString& name, const QByteArray& pcm, const QAudioFormat& format)
+{
+    return sampleCache->upload(name, pcm, format);
+}
+
+bool PULSEAudioPlugin::playSample(const QString& name, qreal volume)
+{
+    return sampleCache->play(name, volume);
+}
+
+bool PULSEAudioPlugin::removeSample(const QString& name)
+{
+    return sampleCache->remove(name);
+}
+
+QObject* PULSEAudioPlugin::output(QIODevice* device)
+{
+    for (int i = 0; i < outputs.size(); i++) {
+        if (outputs.at(i) && outputs.at(i)->plays(device))
+            return outputs.at(i);
+    }
+    return 0;
+}
+
 Q_EXPORT_STATIC_PLUGIN(PULSEAudioPlugin)
 Q_EXPORT_PLUGIN2(pulseaudio, PULSEAudioPlugin)
 
 QT_END_NAMESPACE
 
+#include "main.moc"
+
@@ -19,6 +19,8 @@
 
 #include <QDebug>
 #include <QCoreApplication>
+#include <QMetaType>
+#include <QVarLengthArray>
 
 #include <QtMultimedia/qaudioformat.h>
 
@@ -31,7 +33,12 @@
 #include <unistd.h>
 #include <errno.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "pulseaudio.h"
+#include "alsabackend.h"
 
 PULSEAudioDeviceInfo::PULSEAudioDeviceInfo(QByteArray dev, QAudio::Mode mode)
 {
@@ -171,14 +178,734 @@ void PULSEAudioDeviceInfo::updateLists()
 QList<QByteArray> PULSEAudioDeviceInfo::availableDevices(QAudio::Mode mode)
 {
     QList<QByteArray> devices;
-    if(mode != QAudio::AudioInput)
+    if(mode != QAudio::AudioInput) {
         devices.append("pulse");
+        devices.append("alsa");
+    }
     return devices;
 }
 
+bool pulseSampleSpec(const QAudioFormat& format, pa_sample_spec* spec)
+{
+    spec->format = PA_SAMPLE_S16LE;
+
+    if(format.sampleType() == QAudioFormat::SignedInt) {
+        if(format.sampleSize() == 8) {
+            return false;
+
+        } else if(format.sampleSize() == 16) {
+            if(format.byteOrder() == QAudioFormat::LittleEndian)
+                spec->format = PA_SAMPLE_S16LE;
+            else
+                spec->format = PA_SAMPLE_S16BE;
+        }
+
+    } else if(format.sampleType() == QAudioFormat::UnSignedInt) {
+        if(format.sampleSize() == 8) {
+            spec->format = PA_SAMPLE_U8;
+        } else if(format.sampleSize() == 16) {
+            return false;
+        }
+
+    } else {
+        if(format.sampleSize() == 8) {
+            spec->format = PA_SAMPLE_U8;
+        } else {
+            return false;
+        }
+    }
+    spec->rate = format.frequency();
+    spec->channels = format.channels();
+
+    return true;
+}
+
+// true if every byte of data equals pattern
+static bool isSilent(const char* data, qint64 len, unsigned char pattern)
+{
+    qint64 i = 0;
+
+#ifdef __SSE2__
+    const __m128i fill = _mm_set1_epi8((char)pattern);
+    const __m128i zero = _mm_setzero_si128();
+
+    for(; i + 64 <= len; i += 64) {
+        __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(data+i)), fill);
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(data+i+16)), fill);
+        __m128i c = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(data+i+32)), fill);
+        __m128i d = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(data+i+48)), fill);
+        __m128i acc = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+            return false;
+    }
+#endif
+    for(; i < len; i++) {
+        if((unsigned char)data[i] != pattern)
+            return false;
+    }
+    return true;
+}
+
+PULSEOutputBackend::PULSEOutputBackend(QObject* parent)
+    : QObject(parent)
+{
+}
+
+PULSEOutputBackend::~PULSEOutputBackend() {}
+
+int PULSEOutputBackend::bytesWritable()
+{
+    return -1;
+}
+
+bool PULSEOutputBackend::isPeriodDriven() const
+{
+    return false;
+}
+
+qint64 PULSEOutputBackend::latencyUSecs()
+{
+    return -1;
+}
+
+bool PULSEOutputBackend::isUnreachable() const
+{
+    return false;
+}
+
+void PULSEOutputBackend::setCorked(bool corked)
+{
+    Q_UNUSED(corked)
+}
+
+PULSESimpleBackend::PULSESimpleBackend(const QByteArray& name, const QByteArray& sink,
+        QObject* parent)
+    : PULSEOutputBackend(parent)
+{
+    this->name = name;
+    this->sink = sink;
+    followDefault = true;
+    handle = 0;
+    buffer_size = 0;
+    period_size = 0;
+    err = 0;
+}
+
+PULSESimpleBackend::~PULSESimpleBackend()
+{
+    close();
+}
+
+bool PULSESimpleBackend::open(const QAudioFormat& format, unsigned int bufferTime,
+        unsigned int periodTime)
+{
+    Q_UNUSED(bufferTime)
+    Q_UNUSED(periodTime)
+
+    if(!pulseSampleSpec(format, &params)) {
+        qWarning()<<"unsupported format";
+        err = PA_ERR_NOTSUPPORTED;
+        return false;
+    }
+
+    memset(&attr,0,sizeof(attr));
+    attr.tlength = pa_bytes_per_second(&params)/6;
+    attr.maxlength = (attr.tlength*3)/2;
+    attr.minreq = attr.tlength/50;
+    attr.prebuf = (attr.tlength - attr.minreq)/4;
+    attr.fragsize = attr.tlength/50;
+    buffer_size = attr.tlength*3;
+    period_size = buffer_size/5;
+
+    return connectStream();
+}
+
+bool PULSESimpleBackend::connectStream()
+{
+    // An empty sink name lets the daemon route the stream to its default sink
+    while(!(handle = pa_simple_new(NULL, name.constData(),
+                    PA_STREAM_PLAYBACK, sink.isEmpty() ? NULL : sink.constData(),
+                    QString("pulseaudio:%1").arg(::getpid()).toAscii().constData(),
+                    &params, NULL, &attr, &err))) {
+        // the sink went away, follow the daemon to its default sink
+        if(err == PA_ERR_NOENTITY && !sink.isEmpty() && followDefault) {
+            qWarning()<<"QAudioOutput: sink"<<sink<<"is gone, using the default sink";
+            sink.clear();
+            continue;
+        }
+        qWarning()<<"QAudioOutput failed to open, your pulseaudio daemon is not configured correctly";
+        return false;
+    }
+    return true;
+}
+
+void PULSESimpleBackend::setFollowDefault(bool follow)
+{
+    followDefault = follow;
+}
+
+bool PULSESimpleBackend::isUnreachable() const
+{
+    return !handle && (err == PA_ERR_CONNECTIONREFUSED
+            || err == PA_ERR_CONNECTIONTERMINATED || err == PA_ERR_TIMEOUT);
+}
+
+void PULSESimpleBackend::close()
+{
+    if(handle) {
+        pa_simple_drain(handle, &err);
+        pa_simple_free(handle);
+        handle = 0;
+    }
+}
+
+void PULSESimpleBackend::setCorked(bool corked)
+{
+    // pa_simple can't cork, so give the stream up altogether and let the
+    // sink go idle; a failed reconnect shows up on the next write()
+    if(corked && handle) {
+        pa_simple_flush(handle, &err);
+        pa_simple_free(handle);
+        handle = 0;
+    } else if(!corked && !handle) {
+        connectStream();
+    }
+}
+
+qint64 PULSESimpleBackend::write(const char* data, qint64 len)
+{
+    if(!handle)
+        return -1;
+
+    if (pa_simple_write(handle, data, (size_t)len, &err) < 0) {
+        qWarning()<<"QAudioOutput::write err, can't write to pulseaudio daemon:"<<pa_strerror(err);
+        return -1;
+    }
+    return len;
+}
+
+int PULSESimpleBackend::bufferSize() const
+{
+    return buffer_size;
+}
+
+int PULSESimpleBackend::periodSize() const
+{
+    return period_size;
+}
+
+qint64 PULSESimpleBackend::latencyUSecs()
+{
+    pa_usec_t latency;
+
+    if(!handle)
+        return -1;
+
+    // interpolated from cached timing info, no round trip to the daemon
+    latency = pa_simple_get_latency(handle, &err);
+    if(latency == (pa_usec_t)-1)
+        return -1;
+    return latency;
+}
+
+PULSEHistory::PULSEHistory()
+{
+    total = 0;
+    fill = 0;
+}
+
+void PULSEHistory::resize(int size)
+{
+    ring.resize(size);
+    clear();
+}
+
+void PULSEHistory::clear()
+{
+    total = 0;
+    fill = 0;
+}
+
+void PULSEHistory::append(const char* data, qint64 len)
+{
+    int cap = ring.size();
+    int pos, first;
+
+    if(cap == 0 || len <= 0)
+        return;
+    total += len;
+    if(len > cap) {
+        data += len - cap;
+        len = cap;
+    }
+
+    // fixed ring, at most two copies and no reallocation
+    pos = (int)((total - len) % cap);
+    first = qMin((int)len, cap - pos);
+    memcpy(ring.data() + pos, data, first);
+    memcpy(ring.data(), data + first, (int)len - first);
+    fill = qMin(fill + (int)len, cap);
+}
+
+qint64 PULSEHistory::begin() const
+{
+    return total - fill;
+}
+
+qint64 PULSEHistory::end() const
+{
+    return total;
+}
+
+QByteArray PULSEHistory::mid(qint64 offset, int len) const
+{
+    int cap = ring.size();
+    QByteArray out(len, 0);
+
+    if(len <= 0)
+        return out;
+    int start = (int)(offset % cap);
+    int first = qMin(len, cap - start);
+    memcpy(out.data(), ring.constData() + start, first);
+    memcpy(out.data() + first, ring.constData(), len - first);
+    return out;
+}
+
+PULSEReconnectingBackend::PULSEReconnectingBackend(PULSEOutputBackend* backend, QObject* parent)
+    : PULSEOutputBackend(parent)
+{
+    inner = backend;
+    inner->setParent(this);
+    buffer_time = 0;
+    period_time = 0;
+    bytesPerSecond = 0;
+    frameBytes = 0;
+    history = &ownHistory;
+    pending = 0;
+    unplayed = 0;
+    sinceSample = 0;
+    down = false;
+    gaveUp = false;
+    settled = true;
+    attempts = 0;
+    backoff = RECONNECT_MIN_MS;
+
+    retryTimer = new QTimer(this);
+    retryTimer->setSingleShot(true);
+    connect(retryTimer,SIGNAL(timeout()),SLOT(retry()));
+
+    connect(inner,SIGNAL(periodElapsed()),SIGNAL(periodElapsed()));
+    connect(inner,SIGNAL(underrun()),SIGNAL(underrun()));
+}
+
+PULSEReconnectingBackend::~PULSEReconnectingBackend()
+{
+    close();
+}
+
+bool PULSEReconnectingBackend::open(const QAudioFormat& format, unsigned int bufferTime,
+        unsigned int periodTime)
+{
+    settings = format;
+    buffer_time = bufferTime;
+    period_time = periodTime;
+    frameBytes = format.channels()*(format.sampleSize()/8);
+    bytesPerSecond = format.frequency()*frameBytes;
+
+    backlog.clear();
+    resetHistory();
+    down = false;
+    gaveUp = false;
+    settled = true;
+
+    if(!inner->open(format, bufferTime, periodTime))
+        return false;
+    if(history == &ownHistory)
+        ownHistory.resize(bufferSize());
+    return true;
+}
+
+void PULSEReconnectingBackend::close()
+{
+    retryTimer->stop();
+
+    // whatever is still held client side gets played before the drain
+    if(!down) {
+        if(!backlog.isEmpty())
+            flush(backlog.size());
+        inner->close();
+    }
+    resetHistory();
+    backlog.clear();
+    down = false;
+}
+
+qint64 PULSEReconnectingBackend::write(const char* data, qint64 len)
+{
+    qint64 accepted;
+
+    if(gaveUp)
+        return -1;
+    if(down)
+        return stash(data, len);
+
+    if(backlog.isEmpty()) {
+        pending = len;
+        qint64 written = inner->write(data, len);
+        pending = 0;
+        if(written >= 0) {
+            remember(data, written);
+            settled = true;
+            return written;
+        }
+        // fail() may give up on the spot and emit lost()
+        fail();
+        return gaveUp ? -1 : stash(data, len);
+    }
+
+    // Still catching up after a reconnect: new data queues behind the
+    // backlog, which drains at the pace the output writes.
+    accepted = stash(data, len);
+    pending = len - accepted;
+    if(flush(qMax(accepted, (qint64)periodSize())) > 0)
+        settled = true;
+    pending = 0;
+    return gaveUp ? -1 : accepted;
+}
+
+int PULSEReconnectingBackend::bufferSize() const
+{
+    return inner->bufferSize();
+}
+
+int PULSEReconnectingBackend::periodSize() const
+{
+    return inner->periodSize();
+}
+
+int PULSEReconnectingBackend::bytesWritable()
+{
+    if(down)
+        return qMax(bufferSize() - backlog.size(), 0);
+    return inner->bytesWritable();
+}
+
+bool PULSEReconnectingBackend::isPeriodDriven() const
+{
+    return inner->isPeriodDriven();
+}
+
+qint64 PULSEReconnectingBackend::latencyUSecs()
+{
+    qint64 held = bytesPerSecond > 0 ? qint64(1000000)*backlog.size()/bytesPerSecond : 0;
+
+    if(down)
+        return held;
+    qint64 latency = inner->latencyUSecs();
+    return latency < 0 ? latency : latency + held;
+}
+
+void PULSEReconnectingBackend::setCorked(bool corked)
+{
+    if(down)
+        return;
+
+    if(corked) {
+        if(!backlog.isEmpty() && flush(backlog.size()) < 0)
+            return;
+        resetHistory();
+    }
+    inner->setCorked(corked);
+}
+
+bool PULSEReconnectingBackend::isRecovering() const
+{
+    return down || !backlog.isEmpty();
+}
+
+void PULSEReconnectingBackend::setSharedHistory(PULSEHistory* shared)
+{
+    history = shared ? shared : &ownHistory;
+    if(shared)
+        ownHistory.resize(0);
+}
+
+void PULSEReconnectingBackend::retry()
+{
+    if(!down)
+        return;
+
+    attempts++;
+    if(inner->open(settings, buffer_time, period_time)) {
+        down = false;
+        qWarning()<<"QAudioOutput: stream restored after"<<downTime.elapsed()<<"ms";
+        emit recovered(downTime.elapsed());
+        // get sound going again right away, the rest follows with the writes
+        flush(periodSize());
+        emit periodElapsed();
+        return;
+    }
+
+    scheduleRetry();
+}
+
+void PULSEReconnectingBackend::scheduleRetry()
+{
+    if(attempts >= RECONNECT_ATTEMPTS) {
+        qWarning()<<"QAudioOutput: giving up reconnecting after"<<attempts<<"attempts";
+        gaveUp = true;
+        backlog.clear();
+        emit lost();
+        return;
+    }
+    backoff = qMin(backoff*2, RECONNECT_MAX_MS);
+    retryTimer->start(backoff);
+}
+
+void PULSEReconnectingBackend::fail()
+{
+    qint64 keep;
+
+    qWarning()<<"QAudioOutput: lost the audio stream, reconnecting";
+    inner->close();
+    down = true;
+
+    // Only a write that went through after the last reconnect starts the
+    // backoff over; failing straight after reopening counts as an attempt.
+    bool fresh = settled;
+    if(settled) {
+        attempts = 0;
+        backoff = RECONNECT_MIN_MS;
+        downTime.start();
+        settled = false;
+    }
+
+    // What the device had queued but not played yet goes out again first.
+    // A shared history already holds the write in progress and whatever
+    // this stream has waiting in the backlog.
+    qint64 queued = history->end();
+    if(history != &ownHistory)
+        queued -= pending + backlog.size();
+    keep = qMin(queued - history->begin(), unplayed);
+    if(frameBytes > 0)
+        keep -= keep % frameBytes;
+    if(keep > 0)
+        backlog.prepend(history->mid(queued - keep, (int)keep));
+    resetHistory();
+
+    if(fresh) {
+        emit recovering();
+        retryTimer->start(backoff);
+    } else {
+        scheduleRetry();
+    }
+}
+
+qint64 PULSEReconnectingBackend::stash(const char* data, qint64 len)
+{
+    qint64 room = qMax(bufferSize() - backlog.size(), 0);
+
+    len = qMin(len, room);
+    if(frameBytes > 0)
+        len -= len % frameBytes;
+    if(len > 0)
+        backlog.append(data, (int)len);
+    return len;
+}
+
+qint64 PULSEReconnectingBackend::flush(qint64 len)
+{
+    qint64 written;
+
+    len = qMin(len, (qint64)backlog.size());
+    if(len <= 0)
+        return 0;
+
+    written = inner->write(backlog.constData(), len);
+    if(written < 0) {
+        fail();
+        return -1;
+    }
+    remember(backlog.constData(), written);
+    backlog.remove(0, (int)written);
+    return written;
+}
+
+void PULSEReconnectingBackend::remember(const char* data, qint64 len)
+{
+    if(len <= 0)
+        return;
+    if(history == &ownHistory)
+        ownHistory.append(data, len);
+
+    // Between latency samples everything written counts as still queued,
+    // so a failure replays a little too much rather than too little.
+    unplayed += len;
+    sinceSample += (int)len;
+    if(sinceSample >= periodSize()) {
+        qint64 latency = inner->latencyUSecs();
+        if(latency >= 0)
+            unplayed = latency*bytesPerSecond/1000000;
+        sinceSample = 0;
+    }
+    unplayed = qMin(unplayed, history->end() - history->begin());
+}
+
+void PULSEReconnectingBackend::resetHistory()
+{
+    // a shared history belongs to the owner, only this stream's view resets
+    if(history == &ownHistory)
+        ownHistory.clear();
+    unplayed = 0;
+    sinceSample = 0;
+}
+
+PULSEFanOutBackend::PULSEFanOutBackend(const QByteArray& name, const QList<QByteArray>& sinks,
+        QObject* parent)
+    : PULSEOutputBackend(parent)
+{
+    this->name = name;
+    this->sinks = sinks;
+    bytesPerSecond = 0;
+    frameBytes = 0;
+    silence = 0;
+}
+
+PULSEFanOutBackend::~PULSEFanOutBackend()
+{
+    close();
+}
+
+bool PULSEFanOutBackend::open(const QAudioFormat& format, unsigned int bufferTime,
+        unsigned int periodTime)
+{
+    frameBytes = format.channels()*(format.sampleSize()/8);
+    bytesPerSecond = format.frequency()*frameBytes;
+    silence = (format.sampleType() == QAudioFormat::UnSignedInt
+            && format.sampleSize() == 8) ? (char)0x80 : 0;
+
+    for(int i = 0; i < sinks.size(); i++) {
+        // a zone whose sink is gone is dropped, on the default sink it
+        // would play the program a second time
+        PULSESimpleBackend* simple = new PULSESimpleBackend(name, sinks.at(i));
+        simple->setFollowDefault(false);
+        PULSEReconnectingBackend* stream = new PULSEReconnectingBackend(simple, this);
+        stream->setSharedHistory(&history);
+        if(!stream->open(format, bufferTime, periodTime)) {
+            qWarning()<<"QAudioOutput: can't open sink"<<sinks.at(i)<<"for fan-out";
+            delete stream;
+            continue;
+        }
+        streams.append(stream);
+        streamSinks.append(sinks.at(i));
+    }
+    // one replay history for every sink, each reads it at its own offset
+    history.resize(streams.isEmpty() ? 0 : streams.first()->bufferSize());
+    alignTime.start();
+
+    return !streams.isEmpty();
+}
+
+void PULSEFanOutBackend::close()
+{
+    qDeleteAll(streams);
+    streams.clear();
+    streamSinks.clear();
+    history.clear();
+}
+
+qint64 PULSEFanOutBackend::write(const char* data, qint64 len)
+{
+    qint64 written = -1;
+
+    // The streams replay from here, so it has to hold this write first.
+    // A sink that is reconnecting may take less than the others; resending
+    // the rest would double it on the healthy ones, so report the most.
+    history.append(data, len);
+    for(int i = 0; i < streams.size(); ) {
+        qint64 n = streams.at(i)->write(data, len);
+        if(n < 0) {
+            drop(i);
+            continue;
+        }
+        written = qMax(written, n);
+        i++;
+    }
+
+    if(alignTime.elapsed() > FANOUT_ALIGN_INTERVAL_MS) {
+        align();
+        alignTime.restart();
+    }
+    return written;
+}
+
+int PULSEFanOutBackend::bufferSize() const
+{
+    return streams.isEmpty() ? 0 : streams.first()->bufferSize();
+}
+
+int PULSEFanOutBackend::periodSize() const
+{
+    return streams.isEmpty() ? 0 : streams.first()->periodSize();
+}
+
+qint64 PULSEFanOutBackend::latencyUSecs()
+{
+    qint64 latency = -1;
+
+    for(int i = 0; i < streams.size(); i++)
+        latency = qMax(latency, streams.at(i)->latencyUSecs());
+    return latency;
+}
+
+void PULSEFanOutBackend::setCorked(bool corked)
+{
+    for(int i = 0; i < streams.size(); i++)
+        streams.at(i)->setCorked(corked);
+}
+
+void PULSEFanOutBackend::align()
+{
+    QList<qint64> latency;
+    qint64 target = 0;
+
+    for(int i = 0; i < streams.size(); i++) {
+        latency.append(streams.at(i)->latencyUSecs());
+        target = qMax(target, latency.at(i));
+    }
+
+    for(int i = 0; i < streams.size(); i++) {
+        qint64 behind = target - latency.at(i);
+        qint64 bytes;
+
+        if(latency.at(i) < 0 || behind < FANOUT_ALIGN_MS*1000)
+            continue;
+
+        // Padding is a blocking write ahead of the other sinks, so correct
+        // by at most a period per pass and let later passes do the rest.
+        bytes = qMin(behind*bytesPerSecond/1000000, (qint64)periodSize());
+        if(frameBytes > 0)
+            bytes -= bytes % frameBytes;
+        if(padding.size() < bytes)
+            padding = QByteArray((int)bytes, silence);
+        if(streams.at(i)->write(padding.constData(), bytes) < 0) {
+            latency.removeAt(i);
+            drop(i--);
+        }
+    }
+}
+
+void PULSEFanOutBackend::drop(int i)
+{
+    qWarning()<<"QAudioOutput: lost sink"<<streamSinks.at(i)<<", fan-out continues without it";
+    delete streams.takeAt(i);
+    streamSinks.removeAt(i);
+}
+
 PULSEOutputPrivate::PULSEOutputPrivate(PULSEAudioOutput* audio)
 {
     audioDevice = audio;
+    qRegisterMetaType<QList<qint64> >("QList<qint64>");
 }
 
 PULSEOutputPrivate::~PULSEOutputPrivate() {}
@@ -210,6 +937,34 @@ qint64 PULSEOutputPrivate::writeData(const char* data, qint64 len)
     return written;
 }
 
+qint64 PULSEOutputPrivate::writeBatch(const struct iovec* iov, int count, qint64* accepted)
+{
+    if((audioDevice->state() == QAudio::ActiveState)
+            ||(audioDevice->state() == QAudio::IdleState))
+        return audioDevice->writeBatch(iov, count, accepted);
+
+    for(int i = 0; i < count; i++)
+        accepted[i] = 0;
+    return 0;
+}
+
+QList<qint64> PULSEOutputPrivate::writeBatch(const QList<QByteArray>& buffers)
+{
+    QVarLengthArray<struct iovec, 64> iov(buffers.size());
+    QVarLengthArray<qint64, 64> accepted(buffers.size());
+    QList<qint64> result;
+
+    for(int i = 0; i < buffers.size(); i++) {
+        iov[i].iov_base = (void*)buffers.at(i).constData();
+        iov[i].iov_len = buffers.at(i).size();
+    }
+    writeBatch(iov.data(), buffers.size(), accepted.data());
+
+    for(int i = 0; i < buffers.size(); i++)
+        result.append(accepted[i]);
+    return result;
+}
+
 PULSEAudioOutput::PULSEAudioOutput(const QByteArray &device, const QAudioFormat& format)
 {
     bytesAvailable = 0;
@@ -221,14 +976,26 @@ PULSEAudioOutput::PULSEAudioOutput(const QByteArray &device, const QAudioFormat&
     saveProcessed = 0;
     intervalTime = 1000;
     audioBuffer = 0;
+    audioBufferSize = 0;
+    pendingBytes = 0;
     errorState = QAudio::NoError;
     deviceState = QAudio::StoppedState;
     audioSource = 0;
+    sourceDone = false;
+    feedAborted = false;
     pullMode = true;
-    handle = 0;
+    backend = 0;
+    connected = false;
+    writing = false;
 
     dummyBuffer = 0;
 
+    silenceCorkTime = qgetenv("QT_PULSE_SILENCE_CORK_MS").toInt();
+    silenceByte = -1;
+    silentBytes = 0;
+    corkBytes = 0;
+    corked = false;
+
     settings = format;
 
     m_device = device;
@@ -243,6 +1010,7 @@ PULSEAudioOutput::~PULSEAudioOutput()
     disconnect(timer, SIGNAL(timeout()));
     QCoreApplication::processEvents();
     delete timer;
+    delete[] audioBuffer;
 }
 
 qint64 PULSEAudioOutput::write(const char *data, qint64 len )
@@ -254,25 +1022,54 @@ qint64 PULSEAudioOutput::write(const char *data, qint64 len )
 
     writing = true;
 
+    if (corked)
+        refillCorked();
+
     if (dummyBuffer-(int)length < 0)
         length = dummyBuffer;
 
     if (length == 0) return 0;
 
-    if (pa_simple_write(handle, data, (size_t)length, &err) < 0) {
-        qWarning()<<"QAudioOutput::write err, can't write to pulseaudio daemon";
-        close();
-        connected = false;
-        errorState = QAudio::OpenError;
-        deviceState = QAudio::StoppedState;
-        emit stateChanged(deviceState);
+    if (silenceCorkTime > 0 && silenceByte >= 0) {
+        if (isSilent(data, length, silenceByte)) {
+            silentBytes += length;
+            if (!corked && corkBytes == 0
+                    && silentBytes >= qint64(silenceCorkTime)*bytesPerSecond()/1000) {
+                // Corking drops what the device still holds, so wait until
+                // all of that is silence too.
+                qint64 latency = backend->latencyUSecs();
+                qint64 queued = latency < 0 ? buffer_size : latency*bytesPerSecond()/1000000;
+                corkBytes = qint64(silenceCorkTime)*bytesPerSecond()/1000 + queued;
+            }
+            if (!corked && corkBytes > 0 && silentBytes >= corkBytes)
+                cork();
+        } else {
+            silentBytes = 0;
+            corkBytes = 0;
+            if (corked)
+                uncork();
+        }
+    }
+
+    // silence swallowed while corked still counts as played
+    if (corked) {
+        writeTime.restart();
+        totalTimeValue += length;
+        dummyBuffer -= (int)length;
+        return length;
+    }
+
+    length = backend->write(data, length);
+    if (length < 0 || !connected) {
+        // a lost() emitted from inside the write has already closed us
+        backendLost();
         return 0;
     } else {
         writeTime.restart();
         totalTimeValue += length;
         dummyBuffer -= (int)length;
         errorState = QAudio::NoError;
-        if (deviceState != QAudio::ActiveState) {
+        if (length > 0 && deviceState != QAudio::ActiveState) {
             deviceState = QAudio::ActiveState;
             emit stateChanged(deviceState);
         }
@@ -281,90 +1078,145 @@ qint64 PULSEAudioOutput::write(const char *data, qint64 len )
     return 0;
 }
 
-bool PULSEAudioOutput::open()
+qint64 PULSEAudioOutput::writeBatch(const struct iovec* iov, int count, qint64* accepted)
 {
-    QTime now(QTime::currentTime());
+    qint64 total = 0;
+    qint64 written = 0;
+    int i;
+
+    if(connected && count == 1) {
+        written = write((const char*)iov[0].iov_base, iov[0].iov_len);
+    } else if(connected && count > 1) {
+        if (corked)
+            refillCorked();
+
+        // Push mode leaves audioBuffer free, so gather there and submit
+        // everything at once.  setBufferSize() may have grown the credit
+        // past the allocation, hence the explicit bound.
+        qint64 room = qMin(dummyBuffer, audioBufferSize);
+        for(i = 0; i < count && total < room; i++) {
+            qint64 len = qMin((qint64)iov[i].iov_len, room - total);
+            memcpy(audioBuffer + total, iov[i].iov_base, len);
+            total += len;
+        }
+        written = write(audioBuffer, total);
+    }
 
-    clockTime.restart();
-    timeStamp.restart();
-    writeTime.restart();
+    total = written;
+    for(i = 0; i < count; i++) {
+        accepted[i] = qMin((qint64)iov[i].iov_len, written);
+        written -= accepted[i];
+    }
+    return total;
+}
 
-    count     = 0;
+PULSEOutputBackend* PULSEAudioOutput::tryBackend(PULSEOutputBackend* out, bool* unreachable)
+{
+    PULSEReconnectingBackend* wrapped = new PULSEReconnectingBackend(out, this);
 
-    params.format = PA_SAMPLE_S16LE;
+    if(wrapped->open(settings, buffer_time, period_time)) {
+        connect(wrapped,SIGNAL(lost()),SLOT(backendLost()));
+        return wrapped;
+    }
+    if(unreachable)
+        *unreachable = out->isUnreachable();
+    delete wrapped;
+    return 0;
+}
 
-    if(settings.sampleType() == QAudioFormat::SignedInt) {
-        if(settings.sampleSize() == 8) {
-            qWarning()<<"unsupported format";
-            errorState = QAudio::OpenError;
-            deviceState = QAudio::StoppedState;
-            emit stateChanged(deviceState);
-            return false;
+PULSEOutputBackend* PULSEAudioOutput::openBackend()
+{
+    PULSEOutputBackend* out = 0;
+
+    // "alsa" or "alsa:<pcm>" bypasses the daemon altogether
+    if(m_device == "alsa" || m_device.startsWith("alsa:")) {
+        QByteArray pcm = m_device.mid(5);
+        if(pcm.isEmpty())
+            pcm = "default";
+        return tryBackend(new ALSAOutputBackend(pcm));
+    }
 
-        } else if(settings.sampleSize() == 16) {
-            if(settings.byteOrder() == QAudioFormat::LittleEndian)
-                params.format = PA_SAMPLE_S16LE;
-            else
-                params.format = PA_SAMPLE_S16BE;
-        }
+    // "pulse" is the default sink, "pulse:<sink>" or a bare name picks one
+    QByteArray sink;
+    if(m_device.startsWith("pulse:"))
+        sink = m_device.mid(6);
+    else if(m_device != "pulse")
+        sink = m_device;
+
+    // "pulse:<sink>,<sink>,..." plays to all of them at once
+    QList<QByteArray> sinks = m_sinks;
+    if(sinks.isEmpty() && sink.contains(','))
+        sinks = sink.split(',');
+    if(sinks.size() > 1) {
+        // every sink stream reconnects on its own, no wrapper around them
+        out = new PULSEFanOutBackend(m_device, sinks, this);
+        if(out->open(settings, buffer_time, period_time))
+            return out;
+        delete out;
+        return 0;
+    }
+    if(sinks.size() == 1)
+        sink = sinks.first();
 
-    } else if(settings.sampleType() == QAudioFormat::UnSignedInt) {
-        if(settings.sampleSize() == 8) {
-            params.format = PA_SAMPLE_U8;
-        } else if(settings.sampleSize() == 16) {
-            qWarning()<<"unsupported format";
-            errorState = QAudio::OpenError;
-            deviceState = QAudio::StoppedState;
-            emit stateChanged(deviceState);
-            return false;
-        }
+    bool unreachable = false;
+    if((out = tryBackend(new PULSESimpleBackend(m_device, sink), &unreachable)))
+        return out;
 
-    } else {
-        if(settings.sampleSize() == 8) {
-            params.format = PA_SAMPLE_U8;
-        } else {
-            qWarning()<<"unsupported format";
-            errorState = QAudio::OpenError;
-            deviceState = QAudio::StoppedState;
-            emit stateChanged(deviceState);
-            return false;
-        }
-    }
-    params.rate = settings.frequency();
-    params.channels = settings.channels();
+    // a format the daemon rejects is an error, not a reason to bypass it
+    if(!unreachable)
+        return 0;
 
-    memset(&attr,0,sizeof(attr));
-    attr.tlength = pa_bytes_per_second(&params)/6;
-    attr.maxlength = (attr.tlength*3)/2;
-    attr.minreq = attr.tlength/50;
-    attr.prebuf = (attr.tlength - attr.minreq)/4;
-    attr.fragsize = attr.tlength/50;
-    buffer_size = attr.tlength*3;
-    period_size = buffer_size/5;
+    qWarning()<<"QAudioOutput: no pulseaudio daemon reachable, falling back to direct ALSA output";
+    return tryBackend(new ALSAOutputBackend("default"));
+}
 
-qWarning()<<"f="<<settings.frequency()<<",ch="<<settings.channels()<<", sz="<<settings.sampleSize();
+bool PULSEAudioOutput::open()
+{
+    QTime now(QTime::currentTime());
 
-    if(!(handle = pa_simple_new(NULL, m_device.constData(),
-                    PA_STREAM_PLAYBACK, NULL,
-                    QString("pulseaudio:%1").arg(::getpid()).toAscii().constData(),
-                    &params, NULL, &attr, &err))) {
-        qWarning()<<"QAudioOutput failed to open, your pulseaudio daemon is not configured correctly";
+    clockTime.restart();
+    timeStamp.restart();
+    writeTime.restart();
+
+    count     = 0;
+
+    if(!(backend = openBackend())) {
         errorState = QAudio::OpenError;
         deviceState = QAudio::StoppedState;
         emit stateChanged(deviceState);
         return false;
     }
+    buffer_size = backend->bufferSize();
+    period_size = backend->periodSize();
 
     connected = true;
     writing   = false;
 
-    if(audioBuffer == 0)
+    if(audioBufferSize < buffer_size) {
+        delete[] audioBuffer;
         audioBuffer = new char[buffer_size];
+        audioBufferSize = buffer_size;
+    }
+    pendingBytes = 0;
+
+    // the byte value silence is made of, -1 where it isn't a single one
+    silenceByte = -1;
+    if(settings.sampleType() != QAudioFormat::UnSignedInt)
+        silenceByte = 0;
+    else if(settings.sampleSize() == 8)
+        silenceByte = 0x80;
+    silentBytes = 0;
+    corkBytes = 0;
+    corked = false;
 
     if(pullMode)
         connect(audioSource,SIGNAL(readyRead()),this,SLOT(userFeed()));
 
-    timer->start(20);
+    connect(backend,SIGNAL(underrun()),SLOT(backendUnderrun()));
+    if(backend->isPeriodDriven())
+        connect(backend,SIGNAL(periodElapsed()),SLOT(userFeed()));
+    else
+        timer->start(20);
 
     errorState  = QAudio::NoError;
 
@@ -379,31 +1231,56 @@ void PULSEAudioOutput::userFeed()
     if(deviceState == QAudio::StoppedState || deviceState == QAudio::SuspendedState)
         return;
 
+    int writable = -1;
+    if(corked)
+        refillCorked();
+    else if(backend)
+        writable = backend->bytesWritable();
+    if(writable >= 0)
+        dummyBuffer = qMin(writable, buffer_size);
+
     if(pullMode) {
         // write some audio data and writes it to QIODevice
         while (dummyBuffer >= period_size) {
-            int l = audioSource->read(audioBuffer,period_size);
+            // what a short write left over goes out first
+            int l = readSource(audioBuffer+pendingBytes,period_size-pendingBytes);
+            if(feedAborted) {
+                feedAborted = false;
+                return;
+            }
+            if(l < 0 && pendingBytes == 0) {
+                close();
+                errorState = QAudio::IOError;
+                emit stateChanged(deviceState);
+                break;
+            }
+            l = qMax(l, 0) + pendingBytes;
+            pendingBytes = 0;
+
             if(l > 0) {
                 qint64 bytesWritten = write(audioBuffer,l);
                 if (bytesWritten != l) {
-                    audioSource->seek(audioSource->pos()-(l-bytesWritten));
+                    if (connected) {
+                        pendingBytes = l-bytesWritten;
+                        memmove(audioBuffer, audioBuffer+bytesWritten, pendingBytes);
+                    }
                     break;
                 }
 
-            } else if(l == 0) {
+            } else {
+                QIODevice* source = audioSource;
+                if (!source->isSequential() && source->atEnd()) {
+                    // a sourceFinished() slot may stop or restart the output
+                    finishSource(0);
+                    if (deviceState == QAudio::StoppedState || audioSource != source)
+                        return;
+                }
                 if (deviceState != QAudio::IdleState) {
                     errorState = QAudio::UnderrunError;
                     deviceState = QAudio::IdleState;
                     emit stateChanged(deviceState);
                 }
                 break;
-
-            } else {
-                close();
-                errorState = QAudio::IOError;
-                emit stateChanged(deviceState);
-                break;
-
             }
         }
     } else {
@@ -418,21 +1295,207 @@ void PULSEAudioOutput::userFeed()
         emit notify();
         timeStamp.restart();
     }
-    dummyBuffer+=period_size;
+    if(writable < 0 && !corked) {
+        dummyBuffer+=period_size;
+        if (dummyBuffer > buffer_size) dummyBuffer = buffer_size;
+    }
+}
+
+int PULSEAudioOutput::readSource(char* data, int len)
+{
+    int total = 0;
+
+    // Fill the period across source boundaries so queued sources play
+    // back to back within the same stream.
+    while(total < len) {
+        qint64 l = audioSource->isOpen() ? audioSource->read(data+total,len-total) : -1;
+        if(l < 0) {
+            if(sourceQueue.isEmpty())
+                return total > 0 ? total : -1;
+            if(!nextSource(pendingBytes+total))
+                break;
+            continue;
+        }
+        total += (int)l;
+        if(total == len)
+            break;
+
+        // sequential sources only end when they are closed
+        if(sourceQueue.isEmpty() || audioSource->isSequential() || !audioSource->atEnd())
+            break;
+        if(!nextSource(pendingBytes+total))
+            break;
+    }
+    return total;
+}
+
+void PULSEAudioOutput::finishSource(int buffered)
+{
+    if(sourceDone)
+        return;
+    sourceDone = true;
+
+    // buffered: bytes of this source sitting in audioBuffer, not yet
+    // accounted in totalTimeValue
+    int frameBytes = settings.channels()*(settings.sampleSize()/8);
+    if(frameBytes > 0)
+        emit sourceFinished(audioSource, (totalTimeValue+buffered)/frameBytes);
+}
+
+bool PULSEAudioOutput::nextSource(int buffered)
+{
+    QIODevice* current = audioSource;
+    QIODevice* next = sourceQueue.takeFirst();
+
+    // Dequeue before emitting: a slot connected to sourceFinished() may
+    // clear the queue, stop the output or start it on something else.
+    finishSource(buffered);
+    if(deviceState == QAudio::StoppedState || audioSource != current) {
+        feedAborted = true;
+        return false;
+    }
+
+    disconnect(audioSource,SIGNAL(readyRead()),this,SLOT(userFeed()));
+    audioSource = next;
+    sourceDone = false;
+    connect(audioSource,SIGNAL(readyRead()),this,SLOT(userFeed()));
+    return true;
+}
+
+bool PULSEAudioOutput::enqueue(QIODevice* device)
+{
+    if(!device)
+        return false;
+
+    if(deviceState != QAudio::StoppedState && !pullMode) {
+        qWarning()<<"QAudioOutput::enqueue only works in pull mode";
+        return false;
+    }
+    sourceQueue.append(device);
+
+    // a drained source leaves nothing to wake the output up again
+    if(deviceState == QAudio::IdleState)
+        userFeed();
+
+    return true;
+}
+
+void PULSEAudioOutput::clearQueue()
+{
+    sourceQueue.clear();
+}
+
+int PULSEAudioOutput::queuedSources() const
+{
+    return sourceQueue.size();
+}
+
+bool PULSEAudioOutput::plays(QIODevice* device) const
+{
+    return device && (audioSource == device || sourceQueue.contains(device));
+}
+
+void PULSEAudioOutput::setSilenceCorking(int ms)
+{
+    silenceCorkTime = qMax(0, ms);
+    if(silenceCorkTime == 0 && corked)
+        uncork();
+}
+
+int PULSEAudioOutput::silenceCorking() const
+{
+    return silenceCorkTime;
+}
+
+void PULSEAudioOutput::setFanOutSinks(const QList<QByteArray>& sinks)
+{
+    if (deviceState == QAudio::StoppedState)
+        m_sinks = sinks;
+}
+
+QList<QByteArray> PULSEAudioOutput::fanOutSinks() const
+{
+    return m_sinks;
+}
+
+int PULSEAudioOutput::bytesPerSecond() const
+{
+    return settings.frequency()*settings.channels()*(settings.sampleSize()/8);
+}
+
+void PULSEAudioOutput::cork()
+{
+    corked = true;
+    backend->setCorked(true);
+    corkClock.start();
+
+    // Per-period feeding stops, but the source is still looked at (and
+    // notify() and the idle transition kept going) at the notify interval
+    // or once per buffer length, whichever is shorter.  Period-driven
+    // backends stop signalling while corked, so this is the only clock.
+    int slow = int(qint64(buffer_size)*1000/qMax(bytesPerSecond(), 1));
+    if(intervalTime > 0 && intervalTime < slow)
+        slow = intervalTime;
+    timer->stop();
+    timer->start(qMax(20, slow));
+}
+
+void PULSEAudioOutput::uncork()
+{
+    corked = false;
+    silentBytes = 0;
+    corkBytes = 0;
+    backend->setCorked(false);
+
+    timer->stop();
+    if(!backend->isPeriodDriven())
+        timer->start(20);
+}
+
+void PULSEAudioOutput::refillCorked()
+{
+    // nothing drains the buffer while corked, so credit follows the clock
+    dummyBuffer += int(qint64(corkClock.restart())*bytesPerSecond()/1000);
     if (dummyBuffer > buffer_size) dummyBuffer = buffer_size;
 }
 
+void PULSEAudioOutput::backendUnderrun()
+{
+    if(deviceState == QAudio::ActiveState) {
+        errorState = QAudio::UnderrunError;
+        deviceState = QAudio::IdleState;
+        emit stateChanged(deviceState);
+    }
+}
+
+void PULSEAudioOutput::backendLost()
+{
+    if(!connected)
+        return;
+
+    qWarning()<<"QAudioOutput::write err, can't write to audio device";
+    close();
+    connected = false;
+    errorState = QAudio::OpenError;
+    deviceState = QAudio::StoppedState;
+    emit stateChanged(deviceState);
+}
+
 void PULSEAudioOutput::close()
 {
     deviceState = QAudio::StoppedState;
     timer->stop();
 
-    if(handle) {
-        pa_simple_drain(handle, &err);
-        pa_simple_free(handle);
-        handle = 0;
+    if(backend) {
+        // close() can be reached from one of the backend's own signals
+        backend->disconnect(this);
+        backend->close();
+        backend->deleteLater();
+        backend = 0;
         dummyBuffer = buffer_size;
     }
+    connected = false;
+    corked = false;
 }
 
 QIODevice* PULSEAudioOutput::start(QIODevice* device)
@@ -448,11 +1511,15 @@ QIODevice* PULSEAudioOutput::start(QIODevice* device)
 
     close();
 
+    sourceDone = false;
+
+    // sources enqueued before start() follow the one given here
     if (device) {
         audioSource = device;
         pullMode = true;
         deviceState = QAudio::ActiveState;
     } else {
+        sourceQueue.clear();
         audioSource = new PULSEOutputPrivate(this);
         audioSource->open(QIODevice::WriteOnly|QIODevice::Unbuffered);
         pullMode = false;
@@ -473,6 +1540,7 @@ void PULSEAudioOutput::stop()
         return;
     errorState = QAudio::NoError;
     close();
+    sourceQueue.clear();
     emit stateChanged(deviceState);
 }
 
@@ -506,6 +1574,10 @@ int PULSEAudioOutput::bytesFree() const
 {
     if(deviceState != QAudio::ActiveState && deviceState != QAudio::IdleState)
         return 0;
+    if(corked) {
+        qint64 credit = dummyBuffer + qint64(corkClock.elapsed())*bytesPerSecond()/1000;
+        return (int)qMin(credit, (qint64)buffer_size);
+    }
     return dummyBuffer;
 }
 
@@ -31,10 +31,21 @@
 #include <pulse/simple.h>
 #include <pulse/error.h>
 
+#include <sys/uio.h>
+
 const unsigned int MAX_SAMPLE_RATES = 5;
 const unsigned int SAMPLE_RATES[] =
     { 8000, 11025, 22050, 44100, 48000 };
 
+const int RECONNECT_MIN_MS = 20;
+const int RECONNECT_MAX_MS = 2000;
+const int RECONNECT_ATTEMPTS = 12;
+
+const int FANOUT_ALIGN_MS = 20;
+const int FANOUT_ALIGN_INTERVAL_MS = 250;
+
+bool pulseSampleSpec(const QAudioFormat& format, pa_sample_spec* spec);
+
 class PULSEAudioDeviceInfo : public QAbstractAudioDeviceInfo
 {
     Q_OBJECT
@@ -73,6 +84,192 @@ private:
     int fd;
 };
 
+class PULSEOutputBackend : public QObject
+{
+    Q_OBJECT
+public:
+    PULSEOutputBackend(QObject* parent = 0);
+    virtual ~PULSEOutputBackend();
+
+    virtual bool open(const QAudioFormat& format, unsigned int bufferTime,
+            unsigned int periodTime) = 0;
+    virtual void close() = 0;
+    virtual qint64 write(const char* data, qint64 len) = 0;
+    virtual int bufferSize() const = 0;
+    virtual int periodSize() const = 0;
+    // audio written but not yet heard, -1 if unknown
+    virtual qint64 latencyUSecs();
+    // stop the device without closing, queued audio may be dropped
+    virtual void setCorked(bool corked);
+    // true if open() failed because the sound server could not be reached
+    virtual bool isUnreachable() const;
+    // bytes the device can take right now, -1 if unknown (blocking write)
+    virtual int bytesWritable();
+    // true if periodElapsed() paces the output instead of a timer
+    virtual bool isPeriodDriven() const;
+
+signals:
+    void periodElapsed();
+    void underrun();
+};
+
+class PULSESimpleBackend : public PULSEOutputBackend
+{
+    Q_OBJECT
+public:
+    PULSESimpleBackend(const QByteArray& name, const QByteArray& sink,
+            QObject* parent = 0);
+    ~PULSESimpleBackend();
+
+    bool open(const QAudioFormat& format, unsigned int bufferTime,
+            unsigned int periodTime);
+    void close();
+    qint64 write(const char* data, qint64 len);
+    int bufferSize() const;
+    int periodSize() const;
+    qint64 latencyUSecs();
+    void setCorked(bool corked);
+    bool isUnreachable() const;
+
+    // Whether a stream whose sink has gone follows the daemon to its
+    // default sink (the default) or fails
+    void setFollowDefault(bool follow);
+
+private:
+    bool connectStream();
+
+    QByteArray      name;
+    QByteArray      sink;
+    bool            followDefault;
+    pa_sample_spec  params;
+    pa_simple*      handle;
+    pa_buffer_attr  attr;
+    int             buffer_size;
+    int             period_size;
+    int             err;
+};
+
+// The most recent bytes of a stream in a fixed ring, addressed by absolute
+// stream offset so several readers can share a single copy.
+class PULSEHistory
+{
+public:
+    PULSEHistory();
+
+    void resize(int size);
+    void clear();
+    void append(const char* data, qint64 len);
+    // offsets of the oldest byte still held and just past the newest one
+    qint64 begin() const;
+    qint64 end() const;
+    // len bytes from offset, which must lie within [begin(), end())
+    QByteArray mid(qint64 offset, int len) const;
+
+private:
+    QByteArray ring;
+    qint64 total;
+    int fill;
+};
+
+// Keeps a stream alive across daemon restarts and lost devices: on a write
+// error the wrapped backend is reopened with bounded backoff while the
+// audio it had not played yet, and everything written meanwhile, is held
+// client side and replayed once it is back.
+class PULSEReconnectingBackend : public PULSEOutputBackend
+{
+    Q_OBJECT
+public:
+    PULSEReconnectingBackend(PULSEOutputBackend* backend, QObject* parent = 0);
+    ~PULSEReconnectingBackend();
+
+    bool open(const QAudioFormat& format, unsigned int bufferTime,
+            unsigned int periodTime);
+    void close();
+    qint64 write(const char* data, qint64 len);
+    int bufferSize() const;
+    int periodSize() const;
+    int bytesWritable();
+    bool isPeriodDriven() const;
+    qint64 latencyUSecs();
+    void setCorked(bool corked);
+    bool isRecovering() const;
+
+    // Replay from a history the owner appends every write to before it
+    // reaches this backend, instead of keeping a private copy
+    void setSharedHistory(PULSEHistory* shared);
+
+signals:
+    void recovering();
+    void recovered(int gapMSecs);
+    void lost();
+
+private slots:
+    void retry();
+
+private:
+    void fail();
+    void scheduleRetry();
+    qint64 stash(const char* data, qint64 len);
+    qint64 flush(qint64 len);
+    void remember(const char* data, qint64 len);
+    void resetHistory();
+
+    PULSEOutputBackend* inner;
+    QAudioFormat settings;
+    unsigned int buffer_time;
+    unsigned int period_time;
+    int bytesPerSecond;
+    int frameBytes;
+    PULSEHistory ownHistory;
+    PULSEHistory* history;
+    qint64 pending;
+    QByteArray backlog;
+    qint64 unplayed;
+    int sinceSample;
+    bool down;
+    bool gaveUp;
+    bool settled;
+    int attempts;
+    int backoff;
+    QTimer* retryTimer;
+    QTime downTime;
+};
+
+// One stream per sink fed from the same data. Sinks whose latency falls
+// behind the slowest one get silence inserted so all of them stay in step.
+class PULSEFanOutBackend : public PULSEOutputBackend
+{
+    Q_OBJECT
+public:
+    PULSEFanOutBackend(const QByteArray& name, const QList<QByteArray>& sinks,
+            QObject* parent = 0);
+    ~PULSEFanOutBackend();
+
+    bool open(const QAudioFormat& format, unsigned int bufferTime,
+            unsigned int periodTime);
+    void close();
+    qint64 write(const char* data, qint64 len);
+    int bufferSize() const;
+    int periodSize() const;
+    qint64 latencyUSecs();
+    void setCorked(bool corked);
+
+private:
+    void align();
+    void drop(int i);
+
+    QByteArray name;
+    QList<QByteArray> sinks;
+    QList<PULSEOutputBackend*> streams;
+    QList<QByteArray> streamSinks;
+    PULSEHistory history;
+    QByteArray padding;
+    int bytesPerSecond;
+    int frameBytes;
+    char silence;
+    QTime alignTime;
+};
+
 class PULSEAudioOutput;
 
 class PULSEOutputPrivate : public QIODevice
@@ -85,6 +282,13 @@ public:
     qint64 readData( char* data, qint64 len);
     qint64 writeData(const char* data, qint64 len);
 
+    // Several buffers in one submission; accepted[i] or the returned list
+    // tells how much of each buffer went out, the rest is the caller's.
+    // Applications holding the QIODevice* from start() reach the list
+    // version through QMetaObject::invokeMethod().
+    qint64 writeBatch(const struct iovec* iov, int count, qint64* accepted);
+    Q_INVOKABLE QList<qint64> writeBatch(const QList<QByteArray>& buffers);
+
 private:
     PULSEAudioOutput *audioDevice;
 };
@@ -116,18 +320,52 @@ public:
     QAudioFormat format() const;
     void setFormat(const QAudioFormat& fmt);
 
+    // Gapless queue for pull mode.  QAudioOutput does not expose these;
+    // applications get this object from the plugin's output() slot and
+    // call them through QMetaObject::invokeMethod(), and connect to
+    // sourceFinished() the usual way.
+    Q_INVOKABLE bool enqueue(QIODevice* device);
+    Q_INVOKABLE void clearQueue();
+    Q_INVOKABLE int queuedSources() const;
+    bool plays(QIODevice* device) const;
+
+    void setSilenceCorking(int milliSeconds);
+    int silenceCorking() const;
+
+    void setFanOutSinks(const QList<QByteArray>& sinks);
+    QList<QByteArray> fanOutSinks() const;
+
+signals:
+    void sourceFinished(QIODevice* device, qint64 frame);
+
 private slots:
     void userFeed();
+    void backendUnderrun();
+    void backendLost();
 
 private:
     bool open();
     void close();
+    PULSEOutputBackend* openBackend();
+    PULSEOutputBackend* tryBackend(PULSEOutputBackend* out, bool* unreachable = 0);
+    qint64 writeBatch(const struct iovec* iov, int count, qint64* accepted);
+    int readSource(char* data, int len);
+    void finishSource(int buffered);
+    bool nextSource(int buffered);
+    int bytesPerSecond() const;
+    void cork();
+    void uncork();
+    void refillCorked();
 
     QByteArray m_device;
+    QList<QByteArray> m_sinks;
     QAudioFormat settings;
     QAudio::Error errorState;
     QAudio::State deviceState;
     QIODevice* audioSource;
+    QList<QIODevice*> sourceQueue;
+    bool sourceDone;
+    bool feedAborted;
     bool pullMode;
     QTimer* timer;
     QTime timeStamp;
@@ -135,6 +373,8 @@ private:
     QTime writeTime;
     int intervalTime;
     char* audioBuffer;
+    int audioBufferSize;
+    int pendingBytes;
     int bytesAvailable;
     int buffer_size;
     int period_size;
@@ -143,15 +383,21 @@ private:
     qint64 totalTimeValue;
     qint64 saveProcessed;
 
-    pa_sample_spec  params;
-    pa_simple*      handle;
-    pa_buffer_attr  attr;
+    PULSEOutputBackend* backend;
     bool            connected;
     bool            writing;
     int             count;
-    int             err;
 
     int dummyBuffer;
+
+    int silenceCorkTime;
+    int silenceByte;
+    qint64 silentBytes;
+    qint64 corkBytes;
+    bool corked;
+    QTime corkClock;
 };
 
+Q_DECLARE_METATYPE(QList<qint64>)
+
 #endif
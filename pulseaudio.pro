@@ -5,8 +5,12 @@ CONFIG += qt plugin
 
 QT     += multimedia
 
-LIBS+=-L/usr/lib/i386-linux-gnu -lpulse-simple
+LIBS+=-L/usr/lib/i386-linux-gnu -lpulse-simple -lpulse -lasound
 
-HEADERS += pulseaudio.h
+HEADERS += pulseaudio.h \
+           alsabackend.h \
+           samplecache.h
 SOURCES += main.cpp \
-           pulseaudio.cpp
+           pulseaudio.cpp \
+           alsabackend.cpp \
+           samplecache.cpp
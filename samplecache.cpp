@@ -0,0 +1,228 @@
+/****************************************************************************
+**
+** This file is part of pulseaudio plugin for low-level audio backend in Qt4
+**
+**  pulseaudio Qt4 plugin is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU Lesser General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  pulseaudio Qt4 plugin is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public License
+**  along with pulseaudio Qt4 plugin.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#include <QDebug>
+
+#include <unistd.h>
+
+#include "pulseaudio.h"
+#include "samplecache.h"
+
+PULSESampleCache::PULSESampleCache(QObject* parent)
+    : QObject(parent)
+{
+    mainloop = 0;
+    context = 0;
+}
+
+PULSESampleCache::~PULSESampleCache()
+{
+    disconnectContext();
+}
+
+bool PULSESampleCache::upload(const QString& name, const QByteArray& pcm, const QAudioFormat& format)
+{
+    Sample sample;
+
+    sample.pcm = pcm;
+    sample.format = format;
+
+    if(!connectContext())
+        return false;
+    if(!send(name, sample))
+        return false;
+
+    // kept to upload again should the daemon restart
+    samples.insert(name, sample);
+    return true;
+}
+
+bool PULSESampleCache::play(const QString& name, qreal volume, const QByteArray& sink)
+{
+    pa_operation* op;
+
+    if(!samples.contains(name) || !connectContext())
+        return false;
+
+    // fire and forget: no reply is waited for
+    pa_threaded_mainloop_lock(mainloop);
+    op = pa_context_play_sample(context, name.toUtf8().constData(),
+            sink.isEmpty() ? NULL : sink.constData(),
+            pa_sw_volume_from_linear(qMax(volume, (qreal)0.0)), NULL, NULL);
+    if(op)
+        pa_operation_unref(op);
+    pa_threaded_mainloop_unlock(mainloop);
+
+    return op != 0;
+}
+
+bool PULSESampleCache::remove(const QString& name)
+{
+    pa_operation* op = 0;
+
+    if(!samples.remove(name))
+        return false;
+
+    if(context) {
+        pa_threaded_mainloop_lock(mainloop);
+        op = pa_context_remove_sample(context, name.toUtf8().constData(), NULL, NULL);
+        if(op)
+            pa_operation_unref(op);
+        pa_threaded_mainloop_unlock(mainloop);
+    }
+    return true;
+}
+
+bool PULSESampleCache::contains(const QString& name) const
+{
+    return samples.contains(name);
+}
+
+bool PULSESampleCache::connectContext()
+{
+    pa_context_state_t state;
+
+    if(context) {
+        pa_threaded_mainloop_lock(mainloop);
+        state = pa_context_get_state(context);
+        pa_threaded_mainloop_unlock(mainloop);
+        if(state == PA_CONTEXT_READY)
+            return true;
+
+        // the daemon went away and took the cache with it
+        disconnectContext();
+    }
+
+    mainloop = pa_threaded_mainloop_new();
+    context = pa_context_new(pa_threaded_mainloop_get_api(mainloop),
+            QString("pulseaudio:%1").arg(::getpid()).toAscii().constData());
+    pa_context_set_state_callback(context, contextState, mainloop);
+
+    pa_threaded_mainloop_lock(mainloop);
+    if(pa_context_connect(context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0
+            || pa_threaded_mainloop_start(mainloop) < 0) {
+        pa_threaded_mainloop_unlock(mainloop);
+        qWarning()<<"QAudioOutput sample cache can't connect to the pulseaudio daemon";
+        disconnectContext();
+        return false;
+    }
+    for(;;) {
+        state = pa_context_get_state(context);
+        if(state == PA_CONTEXT_READY || !PA_CONTEXT_IS_GOOD(state))
+            break;
+        pa_threaded_mainloop_wait(mainloop);
+    }
+    pa_threaded_mainloop_unlock(mainloop);
+
+    if(state != PA_CONTEXT_READY) {
+        qWarning()<<"QAudioOutput sample cache can't connect to the pulseaudio daemon";
+        disconnectContext();
+        return false;
+    }
+
+    QMap<QString, Sample>::const_iterator i;
+    for(i = samples.constBegin(); i != samples.constEnd(); ++i)
+        send(i.key(), i.value());
+
+    return true;
+}
+
+void PULSESampleCache::disconnectContext()
+{
+    if(mainloop)
+        pa_threaded_mainloop_stop(mainloop);
+    if(context) {
+        pa_context_disconnect(context);
+        pa_context_unref(context);
+        context = 0;
+    }
+    if(mainloop) {
+        pa_threaded_mainloop_free(mainloop);
+        mainloop = 0;
+    }
+}
+
+bool PULSESampleCache::send(const QString& name, const Sample& sample)
+{
+    pa_sample_spec spec;
+    pa_stream* stream;
+    pa_stream_state_t state;
+
+    if(!pulseSampleSpec(sample.format, &spec) || sample.pcm.isEmpty()) {
+        qWarning()<<"unsupported format";
+        return false;
+    }
+
+    pa_threaded_mainloop_lock(mainloop);
+
+    stream = pa_stream_new(context, name.toUtf8().constData(), &spec, NULL);
+    if(!stream) {
+        pa_threaded_mainloop_unlock(mainloop);
+        return false;
+    }
+    pa_stream_set_state_callback(stream, streamState, mainloop);
+
+    if(pa_stream_connect_upload(stream, sample.pcm.size()) < 0) {
+        pa_stream_unref(stream);
+        pa_threaded_mainloop_unlock(mainloop);
+        return false;
+    }
+    for(;;) {
+        state = pa_stream_get_state(stream);
+        if(state != PA_STREAM_CREATING)
+            break;
+        pa_threaded_mainloop_wait(mainloop);
+    }
+
+    if(state == PA_STREAM_READY
+            && pa_stream_write(stream, sample.pcm.constData(), sample.pcm.size(),
+                NULL, 0, PA_SEEK_RELATIVE) == 0
+            && pa_stream_finish_upload(stream) == 0) {
+        for(;;) {
+            state = pa_stream_get_state(stream);
+            if(state == PA_STREAM_TERMINATED || state == PA_STREAM_FAILED)
+                break;
+            pa_threaded_mainloop_wait(mainloop);
+        }
+    } else {
+        state = PA_STREAM_FAILED;
+    }
+
+    pa_stream_set_state_callback(stream, NULL, NULL);
+    pa_stream_unref(stream);
+    pa_threaded_mainloop_unlock(mainloop);
+
+    if(state != PA_STREAM_TERMINATED) {
+        qWarning()<<"QAudioOutput can't upload sample"<<name<<"to the pulseaudio daemon";
+        return false;
+    }
+    return true;
+}
+
+void PULSESampleCache::contextState(pa_context* c, void* userdata)
+{
+    Q_UNUSED(c)
+    pa_threaded_mainloop_signal((pa_threaded_mainloop*)userdata, 0);
+}
+
+void PULSESampleCache::streamState(pa_stream* s, void* userdata)
+{
+    Q_UNUSED(s)
+    pa_threaded_mainloop_signal((pa_threaded_mainloop*)userdata, 0);
+}
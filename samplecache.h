@@ -0,0 +1,63 @@
+/****************************************************************************
+**
+** This file is part of pulseaudio plugin for low-level audio backend in Qt4
+**
+**  pulseaudio Qt4 plugin is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU Lesser General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  pulseaudio Qt4 plugin is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public License
+**  along with pulseaudio Qt4 plugin.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#ifndef QPULSESAMPLECACHE_H
+#define QPULSESAMPLECACHE_H
+
+#include <QObject>
+#include <QMap>
+#include <QByteArray>
+
+#include <QtMultimedia>
+
+#include <pulse/pulseaudio.h>
+
+// Short sounds uploaded once into the daemon's sample cache and triggered
+// by name, so each play is one small message instead of a whole stream.
+class PULSESampleCache : public QObject
+{
+    Q_OBJECT
+public:
+    PULSESampleCache(QObject* parent = 0);
+    ~PULSESampleCache();
+
+    bool upload(const QString& name, const QByteArray& pcm, const QAudioFormat& format);
+    bool play(const QString& name, qreal volume = 1.0, const QByteArray& sink = QByteArray());
+    bool remove(const QString& name);
+    bool contains(const QString& name) const;
+
+private:
+    struct Sample {
+        QByteArray pcm;
+        QAudioFormat format;
+    };
+
+    bool connectContext();
+    void disconnectContext();
+    bool send(const QString& name, const Sample& sample);
+
+    static void contextState(pa_context* c, void* userdata);
+    static void streamState(pa_stream* s, void* userdata);
+
+    pa_threaded_mainloop* mainloop;
+    pa_context* context;
+    QMap<QString, Sample> samples;
+};
+
+#endif
@@ -0,0 +1,17 @@
+TARGET   = tst_alsanull
+
+TEMPLATE = app
+CONFIG  += qt console
+CONFIG  -= app_bundle
+
+QT      += multimedia
+
+LIBS+=-L/usr/lib/i386-linux-gnu -lpulse-simple -lpulse -lasound
+
+INCLUDEPATH += ../..
+
+HEADERS += ../../pulseaudio.h \
+           ../../alsabackend.h
+SOURCES += main.cpp \
+           ../../pulseaudio.cpp \
+           ../../alsabackend.cpp
@@ -0,0 +1,142 @@
+/****************************************************************************
+**
+** This file is part of pulseaudio plugin for low-level audio backend in Qt4
+**
+**  pulseaudio Qt4 plugin is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU Lesser General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  pulseaudio Qt4 plugin is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public License
+**  along with pulseaudio Qt4 plugin.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+// Pulls one second of audio through the ALSA backend into the null PCM and
+// checks that the period-driven feed consumed exactly that much.
+//
+//   qmake && make && ./tst_alsanull [pcm]
+//
+// Exits 0 on success, 1 on failure.
+
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QTimer>
+
+#include <QtMultimedia>
+
+#include "pulseaudio.h"
+#include "alsabackend.h"
+
+class FeedTest : public QObject
+{
+    Q_OBJECT
+public:
+    FeedTest(const QByteArray& pcm);
+    ~FeedTest();
+
+public slots:
+    void begin();
+    void stateChanged(QAudio::State state);
+    void timeout();
+
+private:
+    void finish(int code);
+
+    QByteArray device;
+    QByteArray data;
+    QBuffer* source;
+    PULSEAudioOutput* output;
+};
+
+FeedTest::FeedTest(const QByteArray& pcm)
+{
+    device = "alsa:" + pcm;
+    source = 0;
+    output = 0;
+}
+
+FeedTest::~FeedTest()
+{
+    delete output;
+    delete source;
+}
+
+void FeedTest::begin()
+{
+    QAudioFormat format;
+    PULSEOutputBackend* backend;
+
+    format.setFrequency(44100);
+    format.setChannels(2);
+    format.setSampleSize(16);
+    format.setSampleType(QAudioFormat::SignedInt);
+    format.setByteOrder(QAudioFormat::LittleEndian);
+    format.setCodec("audio/pcm");
+
+    // one second, a whole number of periods or not
+    data = QByteArray(format.frequency()*4, 1);
+    source = new QBuffer(&data);
+    source->open(QIODevice::ReadOnly);
+
+    output = new PULSEAudioOutput(device, format);
+    connect(output,SIGNAL(stateChanged(QAudio::State)),SLOT(stateChanged(QAudio::State)));
+    output->start(source);
+
+    backend = output->findChild<ALSAOutputBackend*>();
+    if(!backend || !backend->isPeriodDriven()) {
+        qWarning()<<"FAIL: no period-driven ALSA backend on"<<device;
+        finish(1);
+        return;
+    }
+    QTimer::singleShot(10000, this, SLOT(timeout()));
+}
+
+void FeedTest::stateChanged(QAudio::State state)
+{
+    // the source ran dry
+    if(state != QAudio::IdleState)
+        return;
+
+    qint64 consumed = source->pos();
+    qint64 processed = output->processedUSecs();
+    qDebug()<<"consumed"<<consumed<<"of"<<data.size()<<"bytes,"<<processed<<"us processed";
+    if(consumed != data.size() || processed != 1000000) {
+        qWarning()<<"FAIL: expected"<<data.size()<<"bytes and 1000000 us";
+        finish(1);
+        return;
+    }
+    finish(0);
+}
+
+void FeedTest::timeout()
+{
+    qWarning()<<"FAIL: the source was not drained within 10s, read"<<source->pos()<<"bytes";
+    finish(1);
+}
+
+void FeedTest::finish(int code)
+{
+    if(output) {
+        output->disconnect(this);
+        output->stop();
+    }
+    QCoreApplication::exit(code);
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    FeedTest test(argc > 1 ? argv[1] : "null");
+
+    QTimer::singleShot(0, &test, SLOT(begin()));
+    return app.exec();
+}
+
+#include "main.moc"
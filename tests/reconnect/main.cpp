@@ -0,0 +1,238 @@
+/****************************************************************************
+**
+** This file is part of pulseaudio plugin for low-level audio backend in Qt4
+**
+**  pulseaudio Qt4 plugin is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU Lesser General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  pulseaudio Qt4 plugin is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public License
+**  along with pulseaudio Qt4 plugin.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+// Plays into a private pulseaudio daemon with a null sink, kills and
+// restarts the daemon mid-stream and reports the gap the reconnecting
+// backend announces through recovered().
+//
+//   qmake && make && ./tst_reconnect
+//
+// Exits 0 on recovery, 1 on failure; prints SKIP and exits 0 when no
+// pulseaudio binary is around.
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QProcess>
+#include <QTimer>
+
+#include <QtMultimedia>
+
+#include <math.h>
+#include <unistd.h>
+
+#include "pulseaudio.h"
+
+// endless 440Hz sine, 16 bit stereo
+class ToneSource : public QIODevice
+{
+public:
+    ToneSource(int frequency) { rate = frequency; phase = 0; }
+
+    bool isSequential() const { return true; }
+
+protected:
+    qint64 readData(char* data, qint64 len)
+    {
+        qint16* out = (qint16*)data;
+        qint64 frames = len/4;
+
+        for(qint64 i = 0; i < frames; i++, phase++) {
+            qint16 v = (qint16)(8000*sin(2*M_PI*440*phase/rate));
+            out[2*i] = v;
+            out[2*i+1] = v;
+        }
+        return frames*4;
+    }
+    qint64 writeData(const char*, qint64) { return -1; }
+
+private:
+    int rate;
+    qint64 phase;
+};
+
+class ReconnectTest : public QObject
+{
+    Q_OBJECT
+public:
+    ReconnectTest();
+    ~ReconnectTest();
+
+    bool startDaemon();
+
+public slots:
+    void begin();
+    void killDaemon();
+    void restartDaemon();
+    void recovered(int gapMSecs);
+    void lost();
+    void timeout();
+
+private:
+    void finish(int code);
+
+    QString dir;
+    QString socket;
+    QProcess daemon;
+    ToneSource* tone;
+    PULSEAudioOutput* output;
+};
+
+ReconnectTest::ReconnectTest()
+{
+    dir = QDir::temp().filePath(QString("qt-pulse-reconnect-%1").arg(::getpid()));
+    socket = dir + "/native";
+    QDir().mkpath(dir);
+
+    // the daemon keeps all its state in the private directory
+    QStringList env = QProcess::systemEnvironment();
+    env << "HOME=" + dir << "XDG_RUNTIME_DIR=" + dir
+        << "PULSE_RUNTIME_PATH=" + dir << "PULSE_STATE_PATH=" + dir;
+    daemon.setEnvironment(env);
+    daemon.setProcessChannelMode(QProcess::ForwardedChannels);
+
+    // and the plugin talks to nothing else
+    qputenv("PULSE_SERVER", ("unix:" + socket).toLocal8Bit());
+
+    tone = 0;
+    output = 0;
+}
+
+ReconnectTest::~ReconnectTest()
+{
+    delete output;
+    delete tone;
+    if(daemon.state() != QProcess::NotRunning) {
+        daemon.kill();
+        daemon.waitForFinished();
+    }
+    QFile::remove(socket);
+    QDir().rmdir(dir);
+}
+
+bool ReconnectTest::startDaemon()
+{
+    QStringList args;
+
+    QFile::remove(socket);
+    args << "-n" << "--daemonize=no" << "--exit-idle-time=-1"
+         << "--use-pid-file=no" << "--disallow-exit"
+         << "-L" << "module-null-sink sink_name=null"
+         << "-L" << QString("module-native-protocol-unix socket=%1 auth-anonymous=1").arg(socket);
+    daemon.start("pulseaudio", args);
+    if(!daemon.waitForStarted())
+        return false;
+
+    // up once the socket is there
+    for(int i = 0; i < 100 && !QFile::exists(socket); i++)
+        usleep(50000);
+    return QFile::exists(socket);
+}
+
+void ReconnectTest::begin()
+{
+    QAudioFormat format;
+    PULSEReconnectingBackend* backend;
+
+    format.setFrequency(44100);
+    format.setChannels(2);
+    format.setSampleSize(16);
+    format.setSampleType(QAudioFormat::SignedInt);
+    format.setByteOrder(QAudioFormat::LittleEndian);
+    format.setCodec("audio/pcm");
+
+    tone = new ToneSource(format.frequency());
+    tone->open(QIODevice::ReadOnly);
+    output = new PULSEAudioOutput("pulse", format);
+    output->start(tone);
+
+    backend = output->findChild<PULSEReconnectingBackend*>();
+    if(!backend) {
+        qWarning()<<"FAIL: no stream to the daemon";
+        finish(1);
+        return;
+    }
+    connect(backend,SIGNAL(recovered(int)),SLOT(recovered(int)));
+    connect(backend,SIGNAL(lost()),SLOT(lost()));
+
+    QTimer::singleShot(1000, this, SLOT(killDaemon()));
+    QTimer::singleShot(20000, this, SLOT(timeout()));
+}
+
+void ReconnectTest::killDaemon()
+{
+    qDebug()<<"killing the daemon at"<<output->processedUSecs()/1000<<"ms";
+    daemon.kill();
+    daemon.waitForFinished();
+    QTimer::singleShot(300, this, SLOT(restartDaemon()));
+}
+
+void ReconnectTest::restartDaemon()
+{
+    if(!startDaemon()) {
+        qWarning()<<"FAIL: daemon did not come back";
+        finish(1);
+    }
+}
+
+void ReconnectTest::recovered(int gapMSecs)
+{
+    qDebug()<<"recovered after a"<<gapMSecs<<"ms gap";
+    if(output->state() == QAudio::StoppedState) {
+        qWarning()<<"FAIL: output stopped";
+        finish(1);
+        return;
+    }
+    finish(0);
+}
+
+void ReconnectTest::lost()
+{
+    qWarning()<<"FAIL: gave up reconnecting";
+    finish(1);
+}
+
+void ReconnectTest::timeout()
+{
+    qWarning()<<"FAIL: no recovery within 20s";
+    finish(1);
+}
+
+void ReconnectTest::finish(int code)
+{
+    if(output)
+        output->stop();
+    QCoreApplication::exit(code);
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    ReconnectTest test;
+
+    if(!test.startDaemon()) {
+        qDebug()<<"SKIP: can't start pulseaudio";
+        return 0;
+    }
+    QTimer::singleShot(0, &test, SLOT(begin()));
+    return app.exec();
+}
+
+#include "main.moc"